@@ -8,7 +8,21 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <cmath>
+#include <cfloat>
 using namespace std;
 
 // Representation of a .obj model
@@ -19,6 +33,8 @@ typedef struct Model {
     int normals;
     int faces;
     int materials;
+    int prototypes;
+    int instances;
 }
 Model;
 
@@ -173,7 +189,7 @@ void extractOBJdata(string fp, float positions[][3], float texels[][2], float no
 }
 
 // Header creation
-void writeH(string fp, string name, Model model) {
+void writeH(string fp, string name, Model model, bool aos) {
     // Create Header file
     ofstream outH;
     outH.open(fp);
@@ -192,6 +208,10 @@ void writeH(string fp, string name, Model model) {
     outH << "// Faces: " << model.faces << endl;
     outH << "// Vertices: " << model.vertices << endl;
     outH << "// Materials: " << model.materials << endl;
+    if (model.prototypes > 0) {
+        outH << "// Prototypes: " << model.prototypes << endl;
+        outH << "// Instances: " << model.instances << endl;
+    }
     outH << endl;
     
     // Write declarations
@@ -199,6 +219,9 @@ void writeH(string fp, string name, Model model) {
     outH << "const float " << name << "Positions[" << model.vertices*3 << "];" << endl;
     outH << "const float " << name << "Texels[" << model.vertices*2 << "];" << endl;
     outH << "const float " << name << "Normals[" << model.vertices*3 << "];" << endl;
+    if (aos) {
+        outH << "const float " << name << "AOs[" << model.vertices << "];" << endl;
+    }
     outH << endl;
     
     outH << "const int " << name << "Materials;" << endl;
@@ -217,6 +240,17 @@ void writeH(string fp, string name, Model model) {
     outH << "const int " << name << "ILLUMs[" << model.materials << "];" << endl;
     outH << endl;
     
+    // Instancing, prototype vertex ranges per material and 4x3 column-major transforms
+    if (model.prototypes > 0) {
+        outH << "const int " << name << "Prototypes;" << endl;
+        outH << "const int " << name << "PrototypeFirsts[" << model.prototypes << "][" << model.materials << "];" << endl;
+        outH << "const int " << name << "PrototypeCounts[" << model.prototypes << "][" << model.materials << "];" << endl;
+        outH << "const int " << name << "InstanceFirsts[" << model.prototypes << "];" << endl;
+        outH << "const int " << name << "InstanceCounts[" << model.prototypes << "];" << endl;
+        outH << "const float " << name << "Instances[" << model.instances << "][12];" << endl;
+        outH << endl;
+    }
+    
     // Close file
     outH.close();
 }
@@ -669,95 +703,2166 @@ void writeCillums(string fp, string name, Model model, int illum[]) {
     outC.close();
 }
 
-int main(int argc, const char * argv[])
-{
-    // Arguments
-    cout << argc << endl;
-    cout << argv[0] << endl;
-    cout << argv[1] << endl;
+// Block size for reads in pipelined mode
+const size_t kReadBlockSize = 1 << 20;
+
+// Number of blocks or batches in flight between pipeline stages
+const size_t kQueueDepth = 8;
+
+// Faces handed from the parser to the emitter per batch
+const int kBatchFaces = 4096;
+
+// Formatted text kept per material and stream before it is spilled to disk
+const size_t kSpillSize = 64 << 10;
+
+// Bounded queue between pipeline stages
+template <typename T>
+class BoundedQueue {
+public:
+    BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+    
+    // Blocks while the queue is full
+    void push(T item) {
+        unique_lock<mutex> lock(m);
+        notFull.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
     
-    // Filepaths to grab and generate
-    string nameOBJ = argv[1];
-    string filepathOBJ = "source/" + nameOBJ + ".obj";
-    string filepathMTL = "source/" + nameOBJ + ".mtl";
-    string filepathH = "product/" + nameOBJ + ".h";
-    string filepathC = "product/" + nameOBJ + ".c";
+    // Blocks while the queue is empty, returns false once closed and drained
+    bool pop(T &item) {
+        unique_lock<mutex> lock(m);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
     
-    // Model info
-    Model model = getOBJinfo(filepathOBJ);
-    model.materials = getMTLinfo(filepathMTL);
-    cout << "Model info" << endl;
-    cout << "Positions: " << model.positions << endl;
-    cout << "Texels: " << model.texels << endl;
-    cout << "Normals: " << model.normals << endl;
-    cout << "Faces: " << model.faces << endl;
-    cout << "Vertices: " << model.vertices << endl;
-    cout << "Materials: " << model.materials << endl;
+    // No more items will be pushed
+    void close() {
+        lock_guard<mutex> lock(m);
+        closed = true;
+        notEmpty.notify_all();
+    }
+    
+private:
+    size_t capacity;
+    bool closed;
+    deque<T> items;
+    mutex m;
+    condition_variable notFull;
+    condition_variable notEmpty;
+};
+
+// Resolved faces of a single material, in file order
+typedef struct FaceBatch {
+    int material;
+    int faces;
+    vector<float> positions; // 9 per face
+    vector<float> texels; // 6 per face
+    vector<float> normals; // 9 per face
+}
+FaceBatch;
+
+// Formatted .c text of a single material not yet spilled
+typedef struct MaterialBucket {
+    int count;
+    stringstream text[3]; // Positions, texels, normals
+}
+MaterialBucket;
+
+// Spilled text of one material
+typedef struct SpillChunk {
+    int material;
+    long offset;
+    size_t size;
+}
+SpillChunk;
+
+// Temporary file holding the spilled text of one stream, chunks in file order
+typedef struct SpillFile {
+    FILE *file;
+    long size;
+    vector<SpillChunk> chunks;
+}
+SpillFile;
+
+// Positions written straight to .c file while materials arrive in ascending order
+typedef struct DirectStream {
+    string fp;
+    ofstream *out;
+    vector<int> materials; // In .c file order, ascending
+    vector<long> offsets; // Start of each material in .c file
+    bool open; // Last material may still grow
+    int spilled; // Lowest material whose positions are spilled, all written materials are below it
+}
+DirectStream;
+
+// Move buffered text of a material to its spill file
+void spillText(SpillFile &spill, int material, stringstream &text) {
+    string chunk = text.str();
+    if (chunk.empty()) {
+        return;
+    }
+    
+    if (fwrite(chunk.data(), 1, chunk.size(), spill.file) != chunk.size()) {
+        cout << "ERROR WRITING TEMPORARY FILE" << endl;
+        exit(1);
+    }
+    
+    SpillChunk entry = {material, spill.size, chunk.size()};
+    spill.chunks.push_back(entry);
+    spill.size += (long)chunk.size();
+    text.str("");
+}
+
+// Copy the spilled text of a material to .c file
+void copySpill(ofstream &outC, SpillFile &spill, int material) {
+    vector<char> block(kReadBlockSize);
+    
+    for (size_t c = 0; c < spill.chunks.size(); c++) {
+        const SpillChunk &chunk = spill.chunks[c];
+        if (chunk.material != material) {
+            continue;
+        }
+        
+        fseek(spill.file, chunk.offset, SEEK_SET);
+        size_t left = chunk.size;
+        while (left > 0) {
+            size_t n = fread(&block[0], 1, min(left, block.size()), spill.file);
+            if (n == 0) {
+                cout << "ERROR READING TEMPORARY FILE" << endl;
+                exit(1);
+            }
+            outC.write(&block[0], n);
+            left -= n;
+        }
+    }
+}
+
+// Move the written positions of material and every later one back to the spill file, so they can be placed after it
+void demoteDirect(DirectStream &direct, SpillFile &spill, int material) {
+    size_t first = 0;
+    while (first < direct.materials.size() && direct.materials[first] < material) {
+        first++;
+    }
+    direct.open = false;
+    direct.spilled = min(direct.spilled, material);
+    if (first == direct.materials.size()) {
+        return;
+    }
+    
+    direct.out->flush();
+    long end = (long)direct.out->tellp();
+    ifstream inC;
+    inC.open(direct.fp, ios::binary);
+    inC.seekg(direct.offsets[first]);
+    vector<char> block(kReadBlockSize);
+    
+    for (size_t k = first; k < direct.materials.size(); k++) {
+        long stop = k + 1 < direct.materials.size() ? direct.offsets[k+1] : end;
+        SpillChunk entry = {direct.materials[k], spill.size, (size_t)(stop - direct.offsets[k])};
+        
+        size_t left = entry.size;
+        while (left > 0) {
+            inC.read(&block[0], min(left, block.size()));
+            size_t n = (size_t)inC.gcount();
+            if (n == 0 || fwrite(&block[0], 1, n, spill.file) != n) {
+                cout << "ERROR WRITING TEMPORARY FILE" << endl;
+                exit(1);
+            }
+            left -= n;
+        }
+        
+        spill.chunks.push_back(entry);
+        spill.size += (long)entry.size;
+    }
+    inC.close();
+    
+    // Later positions overwrite the demoted text, which is copied back in full so nothing stale remains
+    direct.out->seekp(direct.offsets[first]);
+    direct.materials.resize(first);
+    direct.offsets.resize(first);
+}
+
+// Reader stage: stream the OBJ file in large blocks
+void readOBJblocks(string fp, BoundedQueue<string> *blocks) {
+    ifstream inOBJ;
+    inOBJ.open(fp, ios::binary);
+    
+    if (!inOBJ.good()) {
+        cout << "ERROR OPENING OBJ FILE" << endl;
+        exit(1);
+    }
+    
+    while (inOBJ) {
+        string block(kReadBlockSize, '\0');
+        inOBJ.read(&block[0], kReadBlockSize);
+        block.resize(inOBJ.gcount());
+        
+        if (!block.empty()) {
+            blocks->push(std::move(block));
+        }
+    }
+    
+    inOBJ.close();
+    blocks->close();
+}
+
+// Parse a single OBJ line, handing finished batches to the emitter
+void parseOBJline(const string &line, Model *model, vector<float> &positions, vector<float> &texels, vector<float> &normals, string *materials, FaceBatch *batch, BoundedQueue<FaceBatch> *batches) {
+    string type = line.substr(0,2);
+    const char *c = line.c_str() + 2;
+    char *end;
+    
+    if (type.compare("us") == 0) {
+        // Extract token
+        string l = "usemtl ";
+        string material = line.substr(l.size());
+        int mtl = batch->material;
+        
+        for (int i = 0; i < model->materials; i++) {
+            if (material.compare(materials[i]) == 0) {
+                mtl = i;
+            }
+        }
+        
+        // Faces of the previous material are ready for emission
+        if (mtl != batch->material && batch->faces > 0) {
+            batches->push(std::move(*batch));
+            *batch = FaceBatch();
+        }
+        batch->material = mtl;
+    }
+    
+    else if (type.compare("v ") == 0) {
+        for (int i = 0; i < 3; i++) {
+            positions.push_back(strtod(c, &end));
+            c = end;
+        }
+        model->positions++;
+    }
+    
+    else if (type.compare("vt") == 0) {
+        for (int i = 0; i < 2; i++) {
+            texels.push_back(strtod(c, &end));
+            c = end;
+        }
+        model->texels++;
+    }
+    
+    else if (type.compare("vn") == 0) {
+        for (int i = 0; i < 3; i++) {
+            normals.push_back(strtod(c, &end));
+            c = end;
+        }
+        model->normals++;
+    }
+    
+    else if (type.compare("f ") == 0) {
+        // PTN PTN PTN, same tokenizing as extractOBJdata
+        int ptn[9];
+        for (int i = 0; i < 9; i++) {
+            c += strspn(c, " /");
+            ptn[i] = (int)strtol(c, &end, 10);
+            c = end;
+        }
+        
+        for (int i = 0; i < 3; i++) {
+            int vA = ptn[i*3] - 1;
+            int vtA = ptn[i*3+1] - 1;
+            int vnA = ptn[i*3+2] - 1;
+            
+            if (vA < 0 || vA >= model->positions || vtA < 0 || vtA >= model->texels || vnA < 0 || vnA >= model->normals) {
+                cout << "ERROR INVALID FACE IN OBJ FILE" << endl;
+                exit(1);
+            }
+            
+            batch->positions.insert(batch->positions.end(), &positions[vA*3], &positions[vA*3] + 3);
+            batch->texels.insert(batch->texels.end(), &texels[vtA*2], &texels[vtA*2] + 2);
+            batch->normals.insert(batch->normals.end(), &normals[vnA*3], &normals[vnA*3] + 3);
+        }
+        batch->faces++;
+        model->faces++;
+        
+        if (batch->faces == kBatchFaces) {
+            int mtl = batch->material;
+            batches->push(std::move(*batch));
+            *batch = FaceBatch();
+            batch->material = mtl;
+        }
+    }
+}
 
+// Parser stage: split blocks into lines and resolve faces
+void parseOBJblocks(BoundedQueue<string> *blocks, BoundedQueue<FaceBatch> *batches, Model *model, string *materials) {
     // Model data
-    float positions[model.positions][3]; // XYZ
-    float texels[model.texels][2]; // UV
-    float normals[model.normals][3]; // XYZ
-    int faces[model.faces][10]; // PTN PTN PTN M
+    vector<float> positions; // XYZ
+    vector<float> texels; // UV
+    vector<float> normals; // XYZ
     
-    // Material data
-    string *materials = new string[model.materials];
-    string *map_Kd = new string[model.materials];
-    float kd[model.materials][3];
-    float ks[model.materials][3];
-    float ka[model.materials][3];
-    float ns[model.materials];
-    float ni[model.materials];
-    float d[model.materials];
-    int illum[model.materials];
+    FaceBatch batch = FaceBatch();
+    string pending;
+    string block;
     
-    extractMTLdata(filepathMTL, materials, map_Kd, kd, ks, ka, ns, ni, d, illum);
-    cout << "Name1: " << materials[0] << endl;
-    cout << "Kd1: " << kd[0][0] << "r " << kd[0][1] << "g " << kd[0][2] << "b " << endl;
-    cout << "Ks1: " << ks[0][0] << "r " << ks[0][1] << "g " << ks[0][2] << "b " << endl;
-    cout << "Ka1: " << ka[0][0] << "r " << ka[0][1] << "g " << ka[0][2] << "b " << endl;
-    cout << "Ns1: " << ns[0] << endl;
-    cout << "Ni1: " << ni[0] << endl;
-    cout << "d1: " << d[0] << endl;
-    cout << "illum1: " << illum[0] << endl;
-    cout << "map_Kd1: " << map_Kd[0] << endl;
+    while (blocks->pop(block)) {
+        size_t start = 0;
+        size_t nl;
+        
+        while ((nl = block.find('\n', start)) != string::npos) {
+            if (pending.empty()) {
+                parseOBJline(block.substr(start, nl - start), model, positions, texels, normals, materials, &batch, batches);
+            } else {
+                pending.append(block, start, nl - start);
+                parseOBJline(pending, model, positions, texels, normals, materials, &batch, batches);
+                pending.clear();
+            }
+            start = nl + 1;
+        }
+        
+        // Line continues in the next block
+        pending.append(block, start, string::npos);
+    }
+    
+    // Last line without end of line char
+    if (!pending.empty()) {
+        parseOBJline(pending, model, positions, texels, normals, materials, &batch, batches);
+    }
+    
+    if (batch.faces > 0) {
+        batches->push(std::move(batch));
+    }
+    batches->close();
+    
+    // Number of vertices in OBJ model
+    model->vertices = model->faces*3;
+}
+
+// Emitter stage: format batches into .c text, positions straight to .c file when in order, everything else spilled to disk as it fills
+void emitOBJbatches(BoundedQueue<FaceBatch> *batches, vector<MaterialBucket> *buckets, SpillFile spills[3], DirectStream *direct) {
+    FaceBatch batch;
+    
+    while (batches->pop(batch)) {
+        // Faces without a material are never written, as in writeCpositions
+        if (batch.material >= (int)buckets->size()) {
+            continue;
+        }
+        
+        MaterialBucket &bucket = (*buckets)[batch.material];
+        int last = direct->materials.empty() ? -1 : direct->materials.back();
+        
+        // Positions go to .c file if this material continues it or comes after it, otherwise they wait on disk
+        bool straight = direct->open && batch.material == last;
+        if (!straight && batch.material > last && batch.material < direct->spilled) {
+            direct->materials.push_back(batch.material);
+            direct->offsets.push_back((long)direct->out->tellp());
+            direct->open = true;
+            straight = true;
+        } else if (!straight) {
+            demoteDirect(*direct, spills[0], batch.material);
+        }
+        ostream &positions = straight ? (ostream &)*direct->out : (ostream &)bucket.text[0];
+        
+        for (int i = 0; i < batch.faces*3; i++) {
+            const float *p = &batch.positions[i*3];
+            const float *t = &batch.texels[i*2];
+            const float *n = &batch.normals[i*3];
+            
+            positions << p[0] << ", " << p[1] << ", " << p[2] << ", " << '\n';
+            bucket.text[1] << t[0] << ", " << t[1] << ", " << '\n';
+            bucket.text[2] << n[0] << ", " << n[1] << ", " << n[2] << ", " << '\n';
+        }
+        
+        // 3 vertices per triangular face
+        bucket.count += batch.faces*3;
+        
+        for (int s = 0; s < 3; s++) {
+            if ((size_t)bucket.text[s].tellp() >= kSpillSize) {
+                spillText(spills[s], batch.material, bucket.text[s]);
+            }
+        }
+    }
+    
+    // Everything is on disk once parsing is done
+    for (size_t j = 0; j < buckets->size(); j++) {
+        for (int s = 0; s < 3; s++) {
+            spillText(spills[s], (int)j, (*buckets)[j].text[s]);
+        }
+    }
+}
+
+// Finish .c vertex data: spilled positions after the ones already written, then texels, normals and vertex count
+void writeCbuckets(ofstream &outC, string name, Model model, vector<MaterialBucket> &buckets, SpillFile spills[3], int counts[]) {
+    // Positions, every spilled material follows the written ones
+    for (int j = 0; j < model.materials; j++) {
+        counts[j] = buckets[j].count;
+        copySpill(outC, spills[0], j);
+    }
+    outC << "};" << endl;
+    outC << endl;
+    
+    // Texels
+    outC << "const float " << name << "Texels[" << model.vertices*2 << "] = " << endl;
+    outC << "{" << endl;
+    for (int j = 0; j < model.materials; j++) {
+        copySpill(outC, spills[1], j);
+    }
+    outC << "};" << endl;
+    outC << endl;
+    
+    // Normals
+    outC << "const float " << name << "Normals[" << model.vertices*3 << "] = " << endl;
+    outC << "{" << endl;
+    for (int j = 0; j < model.materials; j++) {
+        copySpill(outC, spills[2], j);
+    }
+    outC << "};";
+    outC << endl;
+    
+    // Vertices, only counted at the end
+    outC << "const int " << name << "Vertices = " << model.vertices << ";" << endl;
+    outC << endl;
+}
+
+// Pipelined conversion: reading, parsing, formatting and writing positions run concurrently.
+// Positions are written to .c file as they are parsed, unsized since the .h declares the size; materials arriving out of order,
+// texels and normals are spilled and copied after parsing, as they follow the positions in .c file.
+void convertOBJpipelined(string fpOBJ, string fpH, string fpC, string name, Model *model, string *materials, int counts[]) {
+    BoundedQueue<string> blocks(kQueueDepth);
+    BoundedQueue<FaceBatch> batches(kQueueDepth);
+    vector<MaterialBucket> buckets(model->materials);
+    SpillFile spills[3];
+    
+    for (int j = 0; j < model->materials; j++) {
+        buckets[j].count = 0;
+    }
+    
+    for (int s = 0; s < 3; s++) {
+        spills[s].file = tmpfile();
+        spills[s].size = 0;
+        
+        if (spills[s].file == NULL) {
+            cout << "ERROR CREATING TEMPORARY FILE" << endl;
+            exit(1);
+        }
+    }
+    
+    // Create .c file
+    ofstream outC;
+    outC.open(fpC, ios::binary);
+    
+    if (!outC.good()) {
+        cout << "ERROR CREATING .c FILE" << endl;
+        exit(1);
+    }
+    
+    outC << "// This is a .c file for the model: " << name << endl;
+    outC << endl;
+    outC << "#include " << "\"" << name << ".h" << "\"" << endl;
+    outC << endl;
+    outC << "const float " << name << "Positions[] = " << endl;
+    outC << "{" << endl;
+    
+    DirectStream direct;
+    direct.fp = fpC;
+    direct.out = &outC;
+    direct.open = false;
+    direct.spilled = model->materials;
     
-    extractOBJdata(filepathOBJ, positions, texels, normals, faces, materials, model.materials);
-    cout << "Model data" << endl;
-    cout << "P1: " << positions[0][0] << "x " << positions[0][1] << "y " << positions[0][2] << "z" << endl;
-    cout << "T1: " << texels[0][0] << "U " << texels[0][1] << "V " << endl;
-    cout << "N1: " << normals[0][0] << "x " << normals[0][1] << "y " << normals[0][2] << "z" << endl;
-    cout << "F1v1: " << faces[0][0] << "p " << faces[0][1] << "t " << faces[0][2] << "n" << endl;
+    thread reader(readOBJblocks, fpOBJ, &blocks);
+    thread parser(parseOBJblocks, &blocks, &batches, model, materials);
+    thread emitter(emitOBJbatches, &batches, &buckets, spills, &direct);
     
-//    cout << "Material references" << endl;
-//    for (int i = 0; i < model.faces; i++) {
-//        int m = faces[i][9];
-//        cout << "F" << i << "m: " << materials[m] << endl;
-//    }
+    reader.join();
+    parser.join();
+    emitter.join();
     
     // Write .h file
-    writeH(filepathH, nameOBJ, model);
+    writeH(fpH, name, *model, false);
     
-    // Materials matching to vertices and faces
-    int firsts[model.materials];
-    int counts[model.materials];
+    // Finish .c file
+    writeCbuckets(outC, name, *model, buckets, spills, counts);
+    outC.close();
+    
+    // Temporary files are removed on close
+    for (int s = 0; s < 3; s++) {
+        fclose(spills[s].file);
+    }
+}
+
+// Cache line size assumed for vertex fetch analysis
+const int kCacheLineSize = 64;
+
+// Cache lines held by the simulated vertex fetch cache
+const int kFetchCacheLines = 64;
+
+// Bytes per vertex of each emitted stream, the last only with ambient occlusion
+const int kVertexStrides[4] = {3*sizeof(float), 2*sizeof(float), 3*sizeof(float), sizeof(float)}; // XYZ UV XYZ AO
+
+// Rendering efficiency of a model as emitted and as if indexed
+typedef struct Analysis {
+    int streams;
+    int cacheSize;
+    bool lru;
+    int triangles;
+    int vertices;
+    int uniqueVertices;
+    int cacheMisses;
+    long long fetchedBytes; // Indexed
+    long long emittedBytes; // As written, same fetch cache
+}
+Analysis;
+
+// Unique P/T/N triplet of a vertex
+typedef struct Triplet {
+    int p;
+    int t;
+    int n;
+    
+    bool operator==(const Triplet &o) const {
+        return p == o.p && t == o.t && n == o.n;
+    }
+}
+Triplet;
+
+typedef struct TripletHash {
+    size_t operator()(const Triplet &v) const {
+        return ((size_t)v.p * 73856093u) ^ ((size_t)v.t * 19349663u) ^ ((size_t)v.n * 83492791u);
+    }
+}
+TripletHash;
+
+// Simulated post-transform vertex cache, FIFO or LRU
+typedef struct VertexCache {
+    int size;
+    bool lru;
+    deque<int> entries; // Most recent first
+    int misses;
+}
+VertexCache;
 
-    // Write .c file
-    writeCvertices(filepathC, nameOBJ, model);
-    writeCpositions(filepathC, nameOBJ, model, faces, positions, counts);
-    writeCtexels(filepathC, nameOBJ, model, faces, texels);
-    writeCnormals(filepathC, nameOBJ, model, faces, normals);
+// Returns true on a cache hit
+bool accessVertexCache(VertexCache &cache, int v) {
+    deque<int>::iterator entry = find(cache.entries.begin(), cache.entries.end(), v);
+    
+    if (entry != cache.entries.end()) {
+        // Only LRU refreshes an entry on a hit
+        if (cache.lru) {
+            cache.entries.erase(entry);
+            cache.entries.push_front(v);
+        }
+        return true;
+    }
     
-    writeCmaterials(filepathC, nameOBJ, model, firsts, counts);
-    writeCkds(filepathC, nameOBJ, model, kd);
-    writeCkas(filepathC, nameOBJ, model, ka);
-    writeCkss(filepathC, nameOBJ, model, ks);
-    writeCnss(filepathC, nameOBJ, model, ns);
-    writeCnis(filepathC, nameOBJ, model, ni);
-    writeCds(filepathC, nameOBJ, model, d);
-    writeCillums(filepathC, nameOBJ, model, illum);
-    writeCmapkds(filepathC, nameOBJ, model, map_Kd); // MIGHT NOT WORK.
+    cache.entries.push_front(v);
+    if ((int)cache.entries.size() > cache.size) {
+        cache.entries.pop_back();
+    }
+    cache.misses++;
+    return false;
+}
+
+// Bytes fetched for vertex index of streams holding count vertices each, lines already in the fetch cache are free
+long long fetchVertex(deque<long long> &lines, int streams, long long count, int index) {
+    long long fetched = 0;
+    long long streamOffset = 0;
+    
+    for (int s = 0; s < streams; s++) {
+        long long first = (streamOffset + (long long)index*kVertexStrides[s]) / kCacheLineSize;
+        long long last = (streamOffset + (long long)(index+1)*kVertexStrides[s] - 1) / kCacheLineSize;
+        streamOffset += count*kVertexStrides[s];
+        
+        for (long long line = first; line <= last; line++) {
+            if (find(lines.begin(), lines.end(), line) != lines.end()) {
+                continue;
+            }
+            lines.push_back(line);
+            if ((int)lines.size() > kFetchCacheLines) {
+                lines.pop_front();
+            }
+            fetched += kCacheLineSize;
+        }
+    }
     
-    return 0;
+    return fetched;
 }
 
+// Simulate the output on a vertex cache of cacheSize entries
+Analysis analyzeOBJdata(Model model, int faces[][10], bool aos, int cacheSize, bool lru) {
+    Analysis analysis = {0};
+    analysis.streams = aos ? 4 : 3;
+    analysis.cacheSize = cacheSize;
+    analysis.lru = lru;
+    
+    VertexCache cache = VertexCache();
+    cache.size = cacheSize;
+    cache.lru = lru;
+    
+    // Indexed vertices are numbered by first use, as an indexer would
+    unordered_map<Triplet, int, TripletHash> indices;
+    indices.reserve(model.vertices);
+    
+    // Fetch caches of line addresses, lines of each stream kept apart
+    deque<long long> lines;
+    deque<long long> emittedLines;
+    int emitted = 0;
+    
+    // Same order as writeCpositions
+    for (int j = 0; j < model.materials; j++) {
+        for (int i = 0; i < model.faces; i++) {
+            if (faces[i][9] != j) {
+                continue;
+            }
+            
+            for (int k = 0; k < 3; k++) {
+                // As written every vertex is fetched in turn
+                analysis.emittedBytes += fetchVertex(emittedLines, analysis.streams, model.vertices, emitted++);
+                
+                Triplet v = {faces[i][k*3], faces[i][k*3+1], faces[i][k*3+2]};
+                int index = (int)indices.size();
+                pair<unordered_map<Triplet, int, TripletHash>::iterator, bool> found = indices.insert(make_pair(v, index));
+                index = found.first->second;
+                
+                if (accessVertexCache(cache, index)) {
+                    continue;
+                }
+                
+                // Vertex shader inputs are fetched on a cache miss only
+                analysis.fetchedBytes += fetchVertex(lines, analysis.streams, model.vertices, index);
+            }
+            
+            analysis.triangles++;
+        }
+    }
+    
+    analysis.vertices = analysis.triangles*3;
+    analysis.uniqueVertices = (int)indices.size();
+    analysis.cacheMisses = cache.misses;
+    
+    return analysis;
+}
+
+// Quote a string for JSON, escaping quotes, backslashes and control characters such as a trailing \r
+string quoteJSON(string text) {
+    string quoted = "\"";
+    
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = text[i];
+        
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += (char)c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        } else {
+            quoted += (char)c;
+        }
+    }
+    
+    return quoted + "\"";
+}
+
+// Write rendering efficiency report as JSON
+void writeJSONanalysis(string fp, string name, Model model, Analysis analysis, string *materials, int firsts[], int counts[]) {
+    // Create .json file
+    ofstream outJSON;
+    outJSON.open(fp);
+    
+    if (!outJSON.good()) {
+        cout << "ERROR CREATING .json FILE" << endl;
+        exit(1);
+    }
+    
+    int vertexSize = 0;
+    for (int s = 0; s < analysis.streams; s++) {
+        vertexSize += kVertexStrides[s];
+    }
+    int indexSize = analysis.uniqueVertices > 65536 ? 4 : 2;
+    double triangles = analysis.triangles > 0 ? analysis.triangles : 1;
+    double uniques = analysis.uniqueVertices > 0 ? analysis.uniqueVertices : 1;
+    
+    outJSON << "{" << endl;
+    outJSON << "  \"model\": " << quoteJSON(name) << "," << endl;
+    outJSON << "  \"cache\": {\"policy\": \"" << (analysis.lru ? "lru" : "fifo") << "\", \"size\": " << analysis.cacheSize << ", \"line\": " << kCacheLineSize << "}," << endl;
+    outJSON << "  \"triangles\": " << analysis.triangles << "," << endl;
+    outJSON << "  \"vertices\": " << analysis.vertices << "," << endl;
+    outJSON << "  \"unique_vertices\": " << analysis.uniqueVertices << "," << endl;
+    outJSON << "  \"duplication\": " << analysis.vertices / uniques << "," << endl;
+    outJSON << "  \"vertex_size\": " << vertexSize << "," << endl;
+    
+    // As written: glDrawArrays, every vertex is transformed and fetched once, overfetch against the same unique data as indexed
+    outJSON << "  \"emitted\": {" << endl;
+    outJSON << "    \"note\": \"acmr and bytes_per_triangle are constant for non-indexed output\"," << endl;
+    outJSON << "    \"acmr\": " << (analysis.triangles > 0 ? 3.0 : 0.0) << "," << endl;
+    outJSON << "    \"atvr\": " << analysis.vertices / uniques << "," << endl;
+    outJSON << "    \"overfetch\": " << analysis.emittedBytes / (uniques*vertexSize) << "," << endl;
+    outJSON << "    \"bytes_per_triangle\": " << 3.0*vertexSize << endl;
+    outJSON << "  }," << endl;
+    
+    // Indexed by unique P/T/N triplet in the same order
+    outJSON << "  \"indexed\": {" << endl;
+    outJSON << "    \"acmr\": " << analysis.cacheMisses / triangles << "," << endl;
+    outJSON << "    \"atvr\": " << analysis.cacheMisses / uniques << "," << endl;
+    outJSON << "    \"overfetch\": " << analysis.fetchedBytes / (uniques*vertexSize) << "," << endl;
+    outJSON << "    \"bytes_per_triangle\": " << ((double)analysis.uniqueVertices*vertexSize + (double)analysis.vertices*indexSize) / triangles << endl;
+    outJSON << "  }," << endl;
+    
+    // Draw ranges per material
+    outJSON << "  \"draws\": [" << endl;
+    for (int i = 0; i < model.materials; i++) {
+        outJSON << "    {\"material\": " << quoteJSON(materials[i]) << ", \"first\": " << firsts[i] << ", \"count\": " << counts[i] << "}";
+        outJSON << (i + 1 < model.materials ? "," : "") << endl;
+    }
+    outJSON << "  ]" << endl;
+    outJSON << "}" << endl;
+    
+    outJSON.close();
+}
+
+// Run body(first, last) over [0, n) in chunks on all cores
+void parallelFor(int n, int chunk, function<void(int, int)> body) {
+    atomic<int> next(0);
+    int workers = max(1, (int)thread::hardware_concurrency());
+    vector<thread> threads;
+    
+    for (int w = 0; w < workers; w++) {
+        threads.push_back(thread([&]() {
+            int first;
+            while ((first = next.fetch_add(chunk)) < n) {
+                body(first, min(n, first + chunk));
+            }
+        }));
+    }
+    
+    for (size_t w = 0; w < threads.size(); w++) {
+        threads[w].join();
+    }
+}
+
+// Evenly spread directions on the unit sphere
+vector<float> sphereDirections(int count) {
+    vector<float> directions(count*3);
+    float golden = (float)(M_PI*(3 - sqrt(5.0)));
+    
+    for (int i = 0; i < count; i++) {
+        float z = 1 - (2*i + 1)/(float)count;
+        float r = sqrt(1 - z*z);
+        directions[i*3] = r*cos(golden*i);
+        directions[i*3+1] = r*sin(golden*i);
+        directions[i*3+2] = z;
+    }
+    
+    return directions;
+}
+
+// Rasterize a triangle given in pixel XY and depth Z.
+// Writes the nearest depth per pixel, or with test returns true if the triangle is in front of depth anywhere.
+bool rasterizeDepth(vector<float> &depth, int res, const float *a, const float *b, const float *c, bool test, float bias) {
+    float area = (b[0]-a[0])*(c[1]-a[1]) - (b[1]-a[1])*(c[0]-a[0]);
+    
+    // Pixels whose center lies within the triangle
+    if (fabs(area) > 1e-12f) {
+        int x0 = max(0, (int)ceil(min(a[0], min(b[0], c[0])) - 0.5f));
+        int x1 = min(res-1, (int)floor(max(a[0], max(b[0], c[0])) - 0.5f));
+        int y0 = max(0, (int)ceil(min(a[1], min(b[1], c[1])) - 0.5f));
+        int y1 = min(res-1, (int)floor(max(a[1], max(b[1], c[1])) - 0.5f));
+        float inv = 1/area;
+        
+        for (int y = y0; y <= y1; y++) {
+            float py = y + 0.5f;
+            for (int x = x0; x <= x1; x++) {
+                float px = x + 0.5f;
+                
+                // Barycentrics, same sign as area inside the triangle
+                float wA = ((b[0]-px)*(c[1]-py) - (b[1]-py)*(c[0]-px))*inv;
+                float wB = ((c[0]-px)*(a[1]-py) - (c[1]-py)*(a[0]-px))*inv;
+                float wC = 1 - wA - wB;
+                if (wA < 0 || wB < 0 || wC < 0) {
+                    continue;
+                }
+                
+                float z = wA*a[2] + wB*b[2] + wC*c[2];
+                float &d = depth[y*res + x];
+                if (test) {
+                    if (z <= d + bias) {
+                        return true;
+                    }
+                } else if (z < d) {
+                    d = z;
+                }
+            }
+        }
+    }
+    
+    // Triangles smaller than a pixel are tested at their centroid
+    if (test) {
+        int x = (int)((a[0] + b[0] + c[0])/3);
+        int y = (int)((a[1] + b[1] + c[1])/3);
+        float z = (a[2] + b[2] + c[2])/3;
+        if (x >= 0 && x < res && y >= 0 && y < res && z <= depth[y*res + x] + bias) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// Remove faces not visible from any of views directions outside the model, returns number removed
+int cullOBJfaces(Model *model, int faces[][10], float positions[][3], int views, int res) {
+    if (model->faces == 0) {
+        return 0;
+    }
+    
+    // Bounding sphere of the model
+    float lo[3] = {INFINITY, INFINITY, INFINITY};
+    float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int i = 0; i < model->faces; i++) {
+        for (int v = 0; v < 3; v++) {
+            int p = faces[i][v*3] - 1;
+            for (int k = 0; k < 3; k++) {
+                lo[k] = min(lo[k], positions[p][k]);
+                hi[k] = max(hi[k], positions[p][k]);
+            }
+        }
+    }
+    
+    float center[3];
+    float radius = 0;
+    for (int k = 0; k < 3; k++) {
+        center[k] = (lo[k] + hi[k])/2;
+        radius += (hi[k] - lo[k])*(hi[k] - lo[k])/4;
+    }
+    radius = max(sqrt(radius), 1e-6f);
+    
+    // Depth differences within two pixels count as visible
+    float scale = res/(2*radius);
+    float bias = 2.0f;
+    
+    vector<float> directions = sphereDirections(views);
+    vector<atomic<bool> > visible(model->faces);
+    for (int i = 0; i < model->faces; i++) {
+        visible[i].store(false, memory_order_relaxed);
+    }
+    
+    // Orthographic views are independent, one per task, each holding only its depth buffer
+    parallelFor(views, 1, [&](int first, int last) {
+        vector<float> depth(res*res);
+        
+        for (int j = first; j < last; j++) {
+            // Basis of the view plane
+            const float *d = &directions[j*3];
+            float up[3] = {0, 0, 1};
+            if (fabs(d[2]) > 0.9f) {
+                up[0] = 1;
+                up[2] = 0;
+            }
+            float u[3] = {up[1]*d[2] - up[2]*d[1], up[2]*d[0] - up[0]*d[2], up[0]*d[1] - up[1]*d[0]};
+            float ul = sqrt(u[0]*u[0] + u[1]*u[1] + u[2]*u[2]);
+            for (int k = 0; k < 3; k++) {
+                u[k] /= ul;
+            }
+            float w[3] = {d[1]*u[2] - d[2]*u[1], d[2]*u[0] - d[0]*u[2], d[0]*u[1] - d[1]*u[0]};
+            
+            // Pixel XY and depth Z in pixels of a face, viewer at infinity along d.
+            // Projected again in each pass, cheap next to rasterizing, so no view holds a copy of the mesh.
+            auto project = [&](int i, float s[9]) {
+                for (int v = 0; v < 3; v++) {
+                    const float *p = positions[faces[i][v*3] - 1];
+                    float q[3] = {p[0]-center[0], p[1]-center[1], p[2]-center[2]};
+                    s[v*3] = (q[0]*u[0] + q[1]*u[1] + q[2]*u[2])*scale + res/2.0f;
+                    s[v*3+1] = (q[0]*w[0] + q[1]*w[1] + q[2]*w[2])*scale + res/2.0f;
+                    s[v*3+2] = -(q[0]*d[0] + q[1]*d[1] + q[2]*d[2])*scale;
+                }
+            };
+            
+            fill(depth.begin(), depth.end(), INFINITY);
+            for (int i = 0; i < model->faces; i++) {
+                float s[9];
+                project(i, s);
+                rasterizeDepth(depth, res, s, s+3, s+6, false, bias);
+            }
+            
+            for (int i = 0; i < model->faces; i++) {
+                if (visible[i].load(memory_order_relaxed)) {
+                    continue;
+                }
+                float s[9];
+                project(i, s);
+                if (rasterizeDepth(depth, res, s, s+3, s+6, true, bias)) {
+                    visible[i].store(true, memory_order_relaxed);
+                }
+            }
+        }
+    });
+    
+    // Compact faces, keeping material order
+    int kept = 0;
+    for (int i = 0; i < model->faces; i++) {
+        if (visible[i].load(memory_order_relaxed)) {
+            if (kept != i) {
+                memcpy(faces[kept], faces[i], sizeof(faces[i]));
+            }
+            kept++;
+        }
+    }
+    
+    int removed = model->faces - kept;
+    model->faces = kept;
+    model->vertices = model->faces*3;
+    
+    return removed;
+}
+
+// Triangles per BVH leaf, tested together
+const int kBVHLeafSize = 4;
+
+// Default occlusion radius of baked ambient occlusion, relative to the model size
+const float kAORadius = 0.1f;
+
+// Four floats processed at once
+typedef float float4 __attribute__((vector_size(16)));
+typedef int int4 __attribute__((vector_size(16)));
+
+// Four triangles of a BVH leaf, as first vertex and edges
+typedef struct TriangleQuad {
+    float4 v0[3];
+    float4 e1[3];
+    float4 e2[3];
+}
+TriangleQuad;
+
+// Bounding volume hierarchy node
+typedef struct BVHNode {
+    float min[3];
+    float max[3];
+    int start; // Quad of a leaf, right child of an inner node
+    int count; // Triangles of a leaf, 0 for inner nodes
+}
+BVHNode;
+
+// Bounding volume hierarchy over the faces of a model
+typedef struct BVH {
+    vector<BVHNode> nodes;
+    vector<TriangleQuad> quads;
+    float extent; // Length of the bounds diagonal
+}
+BVH;
+
+// Split faces [start, start+count) at the median of the largest axis
+int buildBVHnode(BVH &bvh, vector<int> &order, const vector<float> &vertices, const vector<float> &centroids, int start, int count) {
+    int node = (int)bvh.nodes.size();
+    bvh.nodes.push_back(BVHNode());
+    
+    BVHNode bounds;
+    float cmin[3];
+    float cmax[3];
+    for (int k = 0; k < 3; k++) {
+        bounds.min[k] = cmin[k] = INFINITY;
+        bounds.max[k] = cmax[k] = -INFINITY;
+    }
+    
+    for (int i = start; i < start + count; i++) {
+        int f = order[i];
+        for (int k = 0; k < 3; k++) {
+            for (int v = 0; v < 3; v++) {
+                bounds.min[k] = min(bounds.min[k], vertices[f*9 + v*3 + k]);
+                bounds.max[k] = max(bounds.max[k], vertices[f*9 + v*3 + k]);
+            }
+            cmin[k] = min(cmin[k], centroids[f*3 + k]);
+            cmax[k] = max(cmax[k], centroids[f*3 + k]);
+        }
+    }
+    
+    // Leaf, padded with degenerate triangles that never hit
+    if (count <= kBVHLeafSize) {
+        TriangleQuad quad;
+        memset(&quad, 0, sizeof(quad));
+        
+        for (int i = 0; i < count; i++) {
+            const float *v = &vertices[order[start + i]*9];
+            for (int k = 0; k < 3; k++) {
+                quad.v0[k][i] = v[k];
+                quad.e1[k][i] = v[3+k] - v[k];
+                quad.e2[k][i] = v[6+k] - v[k];
+            }
+        }
+        
+        bounds.start = (int)bvh.quads.size();
+        bounds.count = count;
+        bvh.quads.push_back(quad);
+        bvh.nodes[node] = bounds;
+        return node;
+    }
+    
+    int axis = 0;
+    for (int k = 1; k < 3; k++) {
+        if (cmax[k] - cmin[k] > cmax[axis] - cmin[axis]) {
+            axis = k;
+        }
+    }
+    
+    // Coincident centroids are split in file order
+    int half = count/2;
+    if (cmax[axis] - cmin[axis] > 0) {
+        nth_element(order.begin() + start, order.begin() + start + half, order.begin() + start + count, [&](int a, int b) {
+            return centroids[a*3 + axis] < centroids[b*3 + axis];
+        });
+    }
+    
+    // Left child directly follows its parent
+    buildBVHnode(bvh, order, vertices, centroids, start, half);
+    bounds.start = buildBVHnode(bvh, order, vertices, centroids, start + half, count - half);
+    bounds.count = 0;
+    bvh.nodes[node] = bounds;
+    return node;
+}
+
+// Build a BVH over the faces of the model
+BVH buildBVH(Model model, int faces[][10], float positions[][3]) {
+    BVH bvh;
+    bvh.extent = 0;
+    if (model.faces == 0) {
+        return bvh;
+    }
+    
+    vector<float> vertices(model.faces*9);
+    vector<float> centroids(model.faces*3, 0);
+    vector<int> order(model.faces);
+    
+    for (int i = 0; i < model.faces; i++) {
+        for (int v = 0; v < 3; v++) {
+            int p = faces[i][v*3] - 1;
+            for (int k = 0; k < 3; k++) {
+                vertices[i*9 + v*3 + k] = positions[p][k];
+                centroids[i*3 + k] += positions[p][k]/3;
+            }
+        }
+        order[i] = i;
+    }
+    
+    bvh.nodes.reserve(2*model.faces/kBVHLeafSize + 1);
+    bvh.quads.reserve(model.faces/kBVHLeafSize + 1);
+    buildBVHnode(bvh, order, vertices, centroids, 0, model.faces);
+    
+    const BVHNode &root = bvh.nodes[0];
+    for (int k = 0; k < 3; k++) {
+        bvh.extent += (root.max[k] - root.min[k])*(root.max[k] - root.min[k]);
+    }
+    bvh.extent = sqrt(bvh.extent);
+    
+    return bvh;
+}
+
+// Moller-Trumbore against four triangles at once, true if any hits within (tmin, tmax)
+bool intersectQuad(const TriangleQuad &quad, const float o[3], const float d[3], float tmin, float tmax) {
+    float4 dx = {d[0], d[0], d[0], d[0]};
+    float4 dy = {d[1], d[1], d[1], d[1]};
+    float4 dz = {d[2], d[2], d[2], d[2]};
+    
+    float4 px = dy*quad.e2[2] - dz*quad.e2[1];
+    float4 py = dz*quad.e2[0] - dx*quad.e2[2];
+    float4 pz = dx*quad.e2[1] - dy*quad.e2[0];
+    float4 det = quad.e1[0]*px + quad.e1[1]*py + quad.e1[2]*pz;
+    float4 inv = 1/det;
+    
+    float4 sx = o[0] - quad.v0[0];
+    float4 sy = o[1] - quad.v0[1];
+    float4 sz = o[2] - quad.v0[2];
+    float4 u = (sx*px + sy*py + sz*pz)*inv;
+    
+    float4 qx = sy*quad.e1[2] - sz*quad.e1[1];
+    float4 qy = sz*quad.e1[0] - sx*quad.e1[2];
+    float4 qz = sx*quad.e1[1] - sy*quad.e1[0];
+    float4 w = (dx*qx + dy*qy + dz*qz)*inv;
+    float4 t = (quad.e2[0]*qx + quad.e2[1]*qy + quad.e2[2]*qz)*inv;
+    
+    // Degenerate padding has det 0 and fails the first test
+    int4 hit = (det*det > 1e-24f) & (u >= 0) & (w >= 0) & (u + w <= 1) & (t > tmin) & (t < tmax);
+    return (hit[0] | hit[1] | hit[2] | hit[3]) != 0;
+}
+
+// Returns true if the ray hits any face within (tmin, tmax)
+bool occludedBVH(const BVH &bvh, const float o[3], const float d[3], float tmin, float tmax) {
+    if (bvh.nodes.empty()) {
+        return false;
+    }
+    
+    float inv[3];
+    for (int k = 0; k < 3; k++) {
+        inv[k] = 1/d[k];
+    }
+    
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    
+    while (top > 0) {
+        int current = stack[--top];
+        const BVHNode &node = bvh.nodes[current];
+        
+        // Slab test
+        float t0 = tmin;
+        float t1 = tmax;
+        for (int k = 0; k < 3; k++) {
+            float tNear = (node.min[k] - o[k])*inv[k];
+            float tFar = (node.max[k] - o[k])*inv[k];
+            if (tNear > tFar) {
+                swap(tNear, tFar);
+            }
+            t0 = max(t0, tNear);
+            t1 = min(t1, tFar);
+        }
+        if (t0 > t1) {
+            continue;
+        }
+        
+        if (node.count > 0) {
+            if (intersectQuad(bvh.quads[node.start], o, d, tmin, tmax)) {
+                return true;
+            }
+        } else {
+            stack[top++] = node.start;
+            stack[top++] = current + 1;
+        }
+    }
+    
+    return false;
+}
+
+// Bake ambient occlusion per face corner, 1 for fully open
+void bakeOBJocclusion(Model model, int faces[][10], float positions[][3], float normals[][3], float aos[][3], int rays, float radius) {
+    BVH bvh = buildBVH(model, faces, positions);
+    
+    // Occluders farther than radius in model units do not count, 0 for the default relative to the model size
+    if (radius <= 0) {
+        radius = kAORadius*bvh.extent;
+    }
+    float eps = 1e-4f*bvh.extent;
+    
+    // Corners sharing position and normal share occlusion
+    unordered_map<long long, int> uniques;
+    vector<int> corners(model.faces*3);
+    vector<int> sources;
+    
+    for (int i = 0; i < model.faces; i++) {
+        for (int k = 0; k < 3; k++) {
+            long long key = (long long)(faces[i][k*3] - 1)*(model.normals + 1) + faces[i][k*3+2];
+            pair<unordered_map<long long, int>::iterator, bool> found = uniques.insert(make_pair(key, (int)sources.size()));
+            if (found.second) {
+                sources.push_back(i*3 + k);
+            }
+            corners[i*3 + k] = found.first->second;
+        }
+    }
+    
+    // Cosine weighted hemisphere around +Z
+    vector<float> hemisphere(rays*3);
+    float golden = (float)(M_PI*(3 - sqrt(5.0)));
+    for (int r = 0; r < rays; r++) {
+        float s = sqrt((r + 0.5f)/rays);
+        hemisphere[r*3] = s*cos(golden*r);
+        hemisphere[r*3+1] = s*sin(golden*r);
+        hemisphere[r*3+2] = sqrt(1 - s*s);
+    }
+    
+    vector<float> occlusion(sources.size());
+    
+    parallelFor((int)sources.size(), 256, [&](int first, int last) {
+        for (int u = first; u < last; u++) {
+            int f = sources[u]/3;
+            int k = sources[u]%3;
+            const float *p = positions[faces[f][k*3] - 1];
+            const float *vn = normals[faces[f][k*3+2] - 1];
+            
+            float n[3] = {vn[0], vn[1], vn[2]};
+            float len = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+            if (len < 1e-12f) {
+                occlusion[u] = 1;
+                continue;
+            }
+            for (int c = 0; c < 3; c++) {
+                n[c] /= len;
+            }
+            
+            // Tangent frame, rotated per vertex to avoid banding
+            float a[3] = {0, 0, 1};
+            if (fabs(n[2]) > 0.9f) {
+                a[0] = 1;
+                a[2] = 0;
+            }
+            float tx[3] = {a[1]*n[2] - a[2]*n[1], a[2]*n[0] - a[0]*n[2], a[0]*n[1] - a[1]*n[0]};
+            float tl = sqrt(tx[0]*tx[0] + tx[1]*tx[1] + tx[2]*tx[2]);
+            for (int c = 0; c < 3; c++) {
+                tx[c] /= tl;
+            }
+            float ty[3] = {n[1]*tx[2] - n[2]*tx[1], n[2]*tx[0] - n[0]*tx[2], n[0]*tx[1] - n[1]*tx[0]};
+            
+            float angle = golden*(float)(u % 997);
+            float cs = cos(angle);
+            float sn = sin(angle);
+            
+            float o[3];
+            for (int c = 0; c < 3; c++) {
+                o[c] = p[c] + n[c]*eps;
+            }
+            
+            int open = 0;
+            for (int r = 0; r < rays; r++) {
+                const float *h = &hemisphere[r*3];
+                float hx = h[0]*cs - h[1]*sn;
+                float hy = h[0]*sn + h[1]*cs;
+                float d[3];
+                for (int c = 0; c < 3; c++) {
+                    d[c] = tx[c]*hx + ty[c]*hy + n[c]*h[2];
+                }
+                if (!occludedBVH(bvh, o, d, eps, radius)) {
+                    open++;
+                }
+            }
+            
+            occlusion[u] = (float)open/rays;
+        }
+    });
+    
+    for (int i = 0; i < model.faces; i++) {
+        for (int k = 0; k < 3; k++) {
+            aos[i][k] = occlusion[corners[i*3 + k]];
+        }
+    }
+}
+
+// Write .c file of ambient occlusion
+void writeCaos(string fp, string name, Model model, int faces[][10], float aos[][3]) {
+    // Append to .c file
+    ofstream outC;
+    outC.open(fp, ios::app);
+    
+    // AOs
+    outC << "const float " << name << "AOs[" << model.vertices << "] = " << endl;
+    outC << "{" << endl;
+    
+    for (int j = 0; j < model.materials; j++) {
+        for (int i = 0; i < model.faces; i++) {
+            if (faces[i][9] == j) {
+                outC << aos[i][0] << ", " << aos[i][1] << ", " << aos[i][2] << ", " << endl;
+            }
+        }
+    }
+    
+    outC << "};" << endl;
+    outC << endl;
+    
+    outC.close();
+}
+
+// Faces a connected component needs before it is considered for instancing
+const int kInstanceMinFaces = 8;
+
+// Instanced copies of repeated components
+typedef struct Instancing {
+    vector<int> firsts; // Vertex range of each prototype per material
+    vector<int> counts;
+    vector<int> instanceFirsts; // Transform range of each prototype
+    vector<int> instanceCounts;
+    vector<float> transforms; // 4x3 column-major per instance
+}
+Instancing;
+
+// Reference frames tried when matching a component against a prototype,
+// and of those how many may pass the vertex test before the faces are compared
+const int kInstanceMaxFrames = 1024;
+const int kInstanceMaxVerified = 64;
+
+// Connected faces, vertices as welded positions
+typedef struct Component {
+    vector<int> faces;
+    vector<int> vertices; // Welded position indices, each once
+    double centroid[3];
+    double radius; // RMS distance of vertices to centroid
+    double magnitude; // Largest absolute coordinate
+    unsigned long long shape; // Hash of invariants under rigid transforms and reordering
+    int ref[2]; // Vertices spanning the rigid frame, -1 if degenerate
+}
+Component;
+
+// Union-find root with path halving
+int findRoot(vector<int> &parents, int i) {
+    while (parents[i] != i) {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
+
+// 64-bit hash finalizer
+unsigned long long mixHash(unsigned long long x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30))*0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27))*0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// Distance of a position to a point
+double distanceTo(const float *p, const double c[3]) {
+    return sqrt((p[0]-c[0])*(p[0]-c[0]) + (p[1]-c[1])*(p[1]-c[1]) + (p[2]-c[2])*(p[2]-c[2]));
+}
+
+// Matching tolerance: relative to the component size, plus a few float steps at its coordinate magnitude
+double instanceTolerance(const Component &a, const Component &b) {
+    return 1e-4*max(a.radius, b.radius) + 8*FLT_EPSILON*max(a.magnitude, b.magnitude) + 1e-6;
+}
+
+// Orthonormal rows spanned by two vertices around a centroid
+void rigidFrame(const double c[3], const float *a, const float *b, double frame[3][3]) {
+    double u[3] = {a[0]-c[0], a[1]-c[1], a[2]-c[2]};
+    double v[3] = {b[0]-c[0], b[1]-c[1], b[2]-c[2]};
+    double w[3] = {u[1]*v[2] - u[2]*v[1], u[2]*v[0] - u[0]*v[2], u[0]*v[1] - u[1]*v[0]};
+    double ul = sqrt(u[0]*u[0] + u[1]*u[1] + u[2]*u[2]);
+    double wl = sqrt(w[0]*w[0] + w[1]*w[1] + w[2]*w[2]);
+    
+    for (int k = 0; k < 3; k++) {
+        frame[0][k] = u[k]/ul;
+        frame[1][k] = w[k]/wl;
+    }
+    frame[2][0] = frame[0][1]*frame[1][2] - frame[0][2]*frame[1][1];
+    frame[2][1] = frame[0][2]*frame[1][0] - frame[0][0]*frame[1][2];
+    frame[2][2] = frame[0][0]*frame[1][1] - frame[0][1]*frame[1][0];
+}
+
+// Grid cell key of a point
+long long gridKey(long long x, long long y, long long z) {
+    return (long long)mixHash((unsigned long long)x ^ mixHash((unsigned long long)y ^ mixHash((unsigned long long)z)));
+}
+
+// Cosine between the normal of a face corner and the direction from the centroid to it, unchanged by rigid transforms
+double cornerCosine(const int *face, int k, const double c[3], float positions[][3], float normals[][3]) {
+    const float *p = positions[face[k*3] - 1];
+    const float *n = normals[face[k*3+2] - 1];
+    double d = distanceTo(p, c);
+    if (d <= 0) {
+        return 0;
+    }
+    return (n[0]*(p[0]-c[0]) + n[1]*(p[1]-c[1]) + n[2]*(p[2]-c[2]))/d;
+}
+
+// Corners around a vertex of a and one of b alike up to a rigid transform: same materials, texels and normal cosines
+bool sameCorners(const vector<int> &a, const double ca[3], const vector<int> &b, const double cb[3], int faces[][10], float positions[][3], float texels[][2], float normals[][3], double angle) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    
+    vector<char> used(b.size());
+    for (size_t i = 0; i < a.size(); i++) {
+        const int *faceA = faces[a[i]/3];
+        int kA = a[i]%3;
+        const float *ta = texels[faceA[kA*3+1] - 1];
+        double cosA = cornerCosine(faceA, kA, ca, positions, normals);
+        
+        bool found = false;
+        for (size_t j = 0; j < b.size() && !found; j++) {
+            const int *faceB = faces[b[j]/3];
+            int kB = b[j]%3;
+            const float *tb = texels[faceB[kB*3+1] - 1];
+            if (used[j] || faceB[9] != faceA[9] || fabs(ta[0] - tb[0]) > 1e-5f || fabs(ta[1] - tb[1]) > 1e-5f) {
+                continue;
+            }
+            if (fabs(cosA - cornerCosine(faceB, kB, cb, positions, normals)) <= angle) {
+                used[j] = 1;
+                found = true;
+            }
+        }
+        
+        if (!found) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+// Find the rigid transform mapping component a onto b, returns false if they differ.
+// Vertex and face order may differ: frames of b matching a's reference vertices are tried,
+// vertices are then paired by position and faces by their welded vertices.
+// Reference candidates must also match corner attributes, so textured symmetric parts such as bolts need few frames.
+bool matchComponents(const Component &a, const Component &b, const vector<int> &weld, int faces[][10], float positions[][3], float texels[][2], float normals[][3], float transform[12]) {
+    if (a.faces.size() != b.faces.size() || a.vertices.size() != b.vertices.size() || a.shape != b.shape) {
+        return false;
+    }
+    
+    double tol = instanceTolerance(a, b);
+    const float *a0 = positions[a.vertices[a.ref[0]]];
+    const float *a1 = positions[a.vertices[a.ref[1]]];
+    double d0 = distanceTo(a0, a.centroid);
+    double d1 = distanceTo(a1, a.centroid);
+    double d01 = sqrt((a0[0]-a1[0])*(a0[0]-a1[0]) + (a0[1]-a1[1])*(a0[1]-a1[1]) + (a0[2]-a1[2])*(a0[2]-a1[2]));
+    
+    // Normals are rotated by a frame only as accurate as the reference vertices
+    double angle = 1e-3 + 2*tol/d0;
+    
+    // Face corners at a's reference vertices and at each vertex of b, as face*3 + corner
+    vector<int> corners0;
+    vector<int> corners1;
+    for (size_t f = 0; f < a.faces.size(); f++) {
+        for (int k = 0; k < 3; k++) {
+            int p = weld[faces[a.faces[f]][k*3] - 1];
+            if (p == a.vertices[a.ref[0]]) {
+                corners0.push_back(a.faces[f]*3 + k);
+            }
+            if (p == a.vertices[a.ref[1]]) {
+                corners1.push_back(a.faces[f]*3 + k);
+            }
+        }
+    }
+    
+    unordered_map<int, int> localB;
+    for (size_t v = 0; v < b.vertices.size(); v++) {
+        localB[b.vertices[v]] = (int)v;
+    }
+    vector<vector<int> > cornersB(b.vertices.size());
+    for (size_t f = 0; f < b.faces.size(); f++) {
+        for (int k = 0; k < 3; k++) {
+            cornersB[localB[weld[faces[b.faces[f]][k*3] - 1]]].push_back(b.faces[f]*3 + k);
+        }
+    }
+    
+    // Vertices of b that could play the reference vertices, closest distance first
+    vector<pair<double, int> > near0;
+    vector<pair<double, int> > near1;
+    for (size_t v = 0; v < b.vertices.size(); v++) {
+        double d = distanceTo(positions[b.vertices[v]], b.centroid);
+        if (fabs(d - d0) <= 2*tol && sameCorners(corners0, a.centroid, cornersB[v], b.centroid, faces, positions, texels, normals, angle)) {
+            near0.push_back(make_pair(fabs(d - d0), (int)v));
+        }
+        if (fabs(d - d1) <= 2*tol && sameCorners(corners1, a.centroid, cornersB[v], b.centroid, faces, positions, texels, normals, angle)) {
+            near1.push_back(make_pair(fabs(d - d1), (int)v));
+        }
+    }
+    sort(near0.begin(), near0.end());
+    sort(near1.begin(), near1.end());
+    
+    vector<int> candidates0;
+    vector<int> candidates1;
+    for (size_t i = 0; i < near0.size(); i++) {
+        candidates0.push_back(near0[i].second);
+    }
+    for (size_t i = 0; i < near1.size(); i++) {
+        candidates1.push_back(near1[i].second);
+    }
+    
+    // Vertices of b by grid cell, cells larger than the tolerance
+    double cell = 2*tol;
+    unordered_map<long long, vector<int> > grid;
+    for (size_t v = 0; v < b.vertices.size(); v++) {
+        const float *p = positions[b.vertices[v]];
+        grid[gridKey((long long)floor(p[0]/cell), (long long)floor(p[1]/cell), (long long)floor(p[2]/cell))].push_back((int)v);
+    }
+    
+    // Faces of b by material and welded vertices
+    unordered_map<unsigned long long, vector<int> > faceKeys;
+    for (size_t f = 0; f < b.faces.size(); f++) {
+        const int *face = faces[b.faces[f]];
+        int ids[3] = {weld[face[0] - 1], weld[face[3] - 1], weld[face[6] - 1]};
+        sort(ids, ids + 3);
+        faceKeys[mixHash(ids[0] ^ mixHash(ids[1] ^ mixHash(ids[2] ^ mixHash(face[9]))))].push_back((int)f);
+    }
+    
+    // Local index of a's welded vertices
+    unordered_map<int, int> localA;
+    for (size_t v = 0; v < a.vertices.size(); v++) {
+        localA[a.vertices[v]] = (int)v;
+    }
+    
+    vector<int> paired(a.vertices.size());
+    vector<char> used(b.faces.size());
+    int frames = 0;
+    int verified = 0;
+    
+    for (size_t c0 = 0; c0 < candidates0.size(); c0++) {
+        for (size_t c1 = 0; c1 < candidates1.size(); c1++) {
+            const float *b0 = positions[b.vertices[candidates0[c0]]];
+            const float *b1 = positions[b.vertices[candidates1[c1]]];
+            double e01 = sqrt((b0[0]-b1[0])*(b0[0]-b1[0]) + (b0[1]-b1[1])*(b0[1]-b1[1]) + (b0[2]-b1[2])*(b0[2]-b1[2]));
+            if (candidates0[c0] == candidates1[c1] || fabs(e01 - d01) > 2*tol) {
+                continue;
+            }
+            if (frames++ == kInstanceMaxFrames) {
+                return false;
+            }
+            
+            // R = Fb^T Fa maps a's frame onto b's
+            double fa[3][3];
+            double fb[3][3];
+            rigidFrame(a.centroid, a0, a1, fa);
+            rigidFrame(b.centroid, b0, b1, fb);
+            
+            double r[3][3];
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    r[i][j] = fb[0][i]*fa[0][j] + fb[1][i]*fa[1][j] + fb[2][i]*fa[2][j];
+                }
+            }
+            
+            double t[3];
+            for (int i = 0; i < 3; i++) {
+                t[i] = b.centroid[i] - (r[i][0]*a.centroid[0] + r[i][1]*a.centroid[1] + r[i][2]*a.centroid[2]);
+            }
+            
+            // Every vertex must land on a vertex of b
+            bool match = true;
+            for (size_t v = 0; v < a.vertices.size() && match; v++) {
+                const float *p = positions[a.vertices[v]];
+                double q[3];
+                for (int i = 0; i < 3; i++) {
+                    q[i] = r[i][0]*p[0] + r[i][1]*p[1] + r[i][2]*p[2] + t[i];
+                }
+                
+                paired[v] = -1;
+                long long x = (long long)floor(q[0]/cell);
+                long long y = (long long)floor(q[1]/cell);
+                long long z = (long long)floor(q[2]/cell);
+                for (int n = 0; n < 27 && paired[v] < 0; n++) {
+                    unordered_map<long long, vector<int> >::iterator bin = grid.find(gridKey(x + n%3 - 1, y + (n/3)%3 - 1, z + n/9 - 1));
+                    if (bin == grid.end()) {
+                        continue;
+                    }
+                    for (size_t k = 0; k < bin->second.size(); k++) {
+                        const float *s = positions[b.vertices[bin->second[k]]];
+                        if (fabs(q[0] - s[0]) <= tol && fabs(q[1] - s[1]) <= tol && fabs(q[2] - s[2]) <= tol) {
+                            paired[v] = b.vertices[bin->second[k]];
+                            break;
+                        }
+                    }
+                }
+                match = paired[v] >= 0;
+            }
+            
+            if (match && verified++ == kInstanceMaxVerified) {
+                return false;
+            }
+            
+            // Every face must have a counterpart with the same material, texels and rotated normals
+            fill(used.begin(), used.end(), 0);
+            for (size_t f = 0; f < a.faces.size() && match; f++) {
+                const int *faceA = faces[a.faces[f]];
+                int ids[3];
+                for (int k = 0; k < 3; k++) {
+                    ids[k] = paired[localA[weld[faceA[k*3] - 1]]];
+                }
+                int sorted[3] = {ids[0], ids[1], ids[2]};
+                sort(sorted, sorted + 3);
+                
+                match = false;
+                unordered_map<unsigned long long, vector<int> >::iterator key = faceKeys.find(mixHash(sorted[0] ^ mixHash(sorted[1] ^ mixHash(sorted[2] ^ mixHash(faceA[9])))));
+                for (size_t g = 0; key != faceKeys.end() && g < key->second.size() && !match; g++) {
+                    int fb = key->second[g];
+                    const int *faceB = faces[b.faces[fb]];
+                    if (used[fb] || faceB[9] != faceA[9]) {
+                        continue;
+                    }
+                    
+                    match = true;
+                    for (int k = 0; k < 3 && match; k++) {
+                        int m = 0;
+                        while (m < 3 && weld[faceB[m*3] - 1] != ids[k]) {
+                            m++;
+                        }
+                        if (m == 3) {
+                            match = false;
+                            break;
+                        }
+                        
+                        const float *ta = texels[faceA[k*3+1] - 1];
+                        const float *tb = texels[faceB[m*3+1] - 1];
+                        if (fabs(ta[0] - tb[0]) > 1e-5f || fabs(ta[1] - tb[1]) > 1e-5f) {
+                            match = false;
+                        }
+                        
+                        const float *na = normals[faceA[k*3+2] - 1];
+                        const float *nb = normals[faceB[m*3+2] - 1];
+                        for (int i = 0; i < 3; i++) {
+                            if (fabs(r[i][0]*na[0] + r[i][1]*na[1] + r[i][2]*na[2] - nb[i]) > angle) {
+                                match = false;
+                            }
+                        }
+                    }
+                    
+                    if (match) {
+                        used[fb] = 1;
+                    }
+                }
+            }
+            
+            if (!match) {
+                continue;
+            }
+            
+            // Columns of R, then translation
+            for (int j = 0; j < 3; j++) {
+                for (int i = 0; i < 3; i++) {
+                    transform[j*3 + i] = (float)r[i][j];
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                transform[9 + i] = (float)t[i];
+            }
+            
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// Replace repeated connected components by a prototype and instance transforms, returns number of faces removed
+int detectOBJinstances(Model *model, int faces[][10], float positions[][3], float texels[][2], float normals[][3], float aos[][3], Instancing *instancing) {
+    // Identical coordinates are welded into one position
+    vector<int> weld(model->positions);
+    unordered_map<string, int> welded;
+    welded.reserve(model->positions);
+    for (int i = 0; i < model->positions; i++) {
+        string key((const char *)positions[i], sizeof(positions[i]));
+        pair<unordered_map<string, int>::iterator, bool> found = welded.insert(make_pair(key, i));
+        weld[i] = found.first->second;
+    }
+    
+    // Connected components over welded positions
+    vector<int> parents(weld);
+    for (int i = 0; i < model->faces; i++) {
+        int a = findRoot(parents, faces[i][0] - 1);
+        for (int k = 1; k < 3; k++) {
+            int b = findRoot(parents, faces[i][k*3] - 1);
+            if (a != b) {
+                parents[b] = a;
+            }
+        }
+    }
+    
+    vector<Component> components;
+    vector<int> componentOf(model->positions, -1);
+    vector<int> faceComponent(model->faces);
+    for (int i = 0; i < model->faces; i++) {
+        int root = findRoot(parents, faces[i][0] - 1);
+        if (componentOf[root] < 0) {
+            componentOf[root] = (int)components.size();
+            components.push_back(Component());
+        }
+        faceComponent[i] = componentOf[root];
+        components[componentOf[root]].faces.push_back(i);
+    }
+    
+    // Model size for bucketing
+    double lo[3] = {INFINITY, INFINITY, INFINITY};
+    double hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    vector<int> degree(model->positions, 0);
+    
+    for (size_t c = 0; c < components.size(); c++) {
+        Component &comp = components[c];
+        
+        // Shape invariants: materials of faces and corners per vertex, independent of order
+        unsigned long long materials = 0;
+        for (size_t f = 0; f < comp.faces.size(); f++) {
+            const int *face = faces[comp.faces[f]];
+            for (int k = 0; k < 3; k++) {
+                int p = weld[face[k*3] - 1];
+                if (degree[p]++ == 0) {
+                    comp.vertices.push_back(p);
+                }
+            }
+            materials += mixHash(face[9]);
+        }
+        
+        unsigned long long degrees = 0;
+        for (int k = 0; k < 3; k++) {
+            comp.centroid[k] = 0;
+        }
+        comp.magnitude = 0;
+        for (size_t v = 0; v < comp.vertices.size(); v++) {
+            const float *p = positions[comp.vertices[v]];
+            for (int k = 0; k < 3; k++) {
+                comp.centroid[k] += p[k];
+                lo[k] = min(lo[k], (double)p[k]);
+                hi[k] = max(hi[k], (double)p[k]);
+                comp.magnitude = max(comp.magnitude, (double)fabs(p[k]));
+            }
+            degrees += mixHash(degree[comp.vertices[v]]);
+            degree[comp.vertices[v]] = 0;
+        }
+        for (int k = 0; k < 3; k++) {
+            comp.centroid[k] /= comp.vertices.size();
+        }
+        comp.shape = mixHash(comp.faces.size() ^ mixHash(comp.vertices.size() ^ mixHash(materials ^ mixHash(degrees))));
+        
+        // Farthest vertex, then the one spanning the largest area with it
+        comp.radius = 0;
+        comp.ref[0] = 0;
+        double farthest = 0;
+        for (size_t v = 0; v < comp.vertices.size(); v++) {
+            double d = distanceTo(positions[comp.vertices[v]], comp.centroid);
+            comp.radius += d*d/comp.vertices.size();
+            if (d > farthest) {
+                farthest = d;
+                comp.ref[0] = (int)v;
+            }
+        }
+        comp.radius = sqrt(comp.radius);
+        
+        const float *r0 = positions[comp.vertices[comp.ref[0]]];
+        double u[3] = {r0[0]-comp.centroid[0], r0[1]-comp.centroid[1], r0[2]-comp.centroid[2]};
+        double largest = 0;
+        comp.ref[1] = -1;
+        for (size_t v = 0; v < comp.vertices.size(); v++) {
+            const float *p = positions[comp.vertices[v]];
+            double w[3] = {p[0]-comp.centroid[0], p[1]-comp.centroid[1], p[2]-comp.centroid[2]};
+            double x[3] = {u[1]*w[2] - u[2]*w[1], u[2]*w[0] - u[0]*w[2], u[0]*w[1] - u[1]*w[0]};
+            double area = x[0]*x[0] + x[1]*x[1] + x[2]*x[2];
+            if (area > largest) {
+                largest = area;
+                comp.ref[1] = (int)v;
+            }
+        }
+        
+        // Collinear components have no unique rigid frame
+        if (largest <= 1e-12*farthest*farthest*farthest*farthest) {
+            comp.ref[0] = comp.ref[1] = -1;
+        }
+    }
+    
+    double extent = 0;
+    if (model->faces > 0) {
+        extent = sqrt((hi[0]-lo[0])*(hi[0]-lo[0]) + (hi[1]-lo[1])*(hi[1]-lo[1]) + (hi[2]-lo[2])*(hi[2]-lo[2]));
+    }
+    double cell = 1e-3*extent + 1e-6;
+    
+    // Candidates bucketed by shape and radius, radius cells within the tolerance are searched too
+    unordered_map<unsigned long long, vector<int> > buckets;
+    vector<int> prototypeOf(components.size(), -1);
+    vector<vector<float> > copies(components.size());
+    
+    for (size_t c = 0; c < components.size(); c++) {
+        Component &comp = components[c];
+        if ((int)comp.faces.size() < kInstanceMinFaces || comp.ref[0] < 0) {
+            continue;
+        }
+        
+        long long cellIndex = (long long)floor(comp.radius/cell);
+        long long span = 1 + (long long)(instanceTolerance(comp, comp)/cell);
+        float transform[12];
+        
+        for (long long q = cellIndex - span; q <= cellIndex + span && prototypeOf[c] < 0; q++) {
+            unordered_map<unsigned long long, vector<int> >::iterator bucket = buckets.find(comp.shape ^ mixHash(q));
+            if (bucket == buckets.end()) {
+                continue;
+            }
+            
+            for (size_t b = 0; b < bucket->second.size(); b++) {
+                int p = bucket->second[b];
+                if (matchComponents(components[p], comp, weld, faces, positions, texels, normals, transform)) {
+                    prototypeOf[c] = p;
+                    copies[p].insert(copies[p].end(), transform, transform + 12);
+                    break;
+                }
+            }
+        }
+        
+        if (prototypeOf[c] < 0) {
+            buckets[comp.shape ^ mixHash(cellIndex)].push_back((int)c);
+        }
+    }
+    
+    // Prototypes are the components that were copied, in file order
+    vector<int> prototypeIndex(components.size(), -1);
+    int prototypes = 0;
+    for (size_t c = 0; c < components.size(); c++) {
+        if (!copies[c].empty()) {
+            prototypeIndex[c] = prototypes++;
+            instancing->instanceFirsts.push_back((int)instancing->transforms.size()/12);
+            instancing->instanceCounts.push_back((int)copies[c].size()/12);
+            instancing->transforms.insert(instancing->transforms.end(), copies[c].begin(), copies[c].end());
+        }
+    }
+    
+    // Drop copies, static faces then each prototype in turn so its faces are contiguous per material
+    vector<int> order;
+    vector<int> keys(model->faces);
+    order.reserve(model->faces);
+    for (int i = 0; i < model->faces; i++) {
+        int c = faceComponent[i];
+        if (prototypeOf[c] >= 0) {
+            continue;
+        }
+        keys[i] = prototypeIndex[c] + 1;
+        order.push_back(i);
+    }
+    stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return keys[a] < keys[b];
+    });
+    
+    vector<int> kept((int)order.size()*10);
+    vector<float> keptAOs(aos != NULL ? order.size()*3 : 0);
+    for (size_t i = 0; i < order.size(); i++) {
+        memcpy(&kept[i*10], faces[order[i]], sizeof(faces[0]));
+        if (aos != NULL) {
+            memcpy(&keptAOs[i*3], aos[order[i]], sizeof(aos[0]));
+        }
+    }
+    for (size_t i = 0; i < order.size(); i++) {
+        memcpy(faces[i], &kept[i*10], sizeof(faces[0]));
+        if (aos != NULL) {
+            memcpy(aos[i], &keptAOs[i*3], sizeof(aos[0]));
+        }
+    }
+    
+    int removed = model->faces - (int)order.size();
+    model->faces = (int)order.size();
+    model->vertices = model->faces*3;
+    model->prototypes = prototypes;
+    model->instances = (int)instancing->transforms.size()/12;
+    
+    // Vertex ranges in the order of writeCpositions
+    instancing->firsts.assign(prototypes*model->materials, 0);
+    instancing->counts.assign(prototypes*model->materials, 0);
+    int first = 0;
+    for (int j = 0; j < model->materials; j++) {
+        for (int i = 0; i < model->faces; i++) {
+            if (faces[i][9] != j) {
+                continue;
+            }
+            
+            int p = keys[order[i]] - 1;
+            if (p >= 0) {
+                if (instancing->counts[p*model->materials + j] == 0) {
+                    instancing->firsts[p*model->materials + j] = first;
+                }
+                instancing->counts[p*model->materials + j] += 3;
+            }
+            first += 3;
+        }
+    }
+    
+    return removed;
+}
+
+// Write .c file of prototypes and instance transforms
+void writeCinstances(string fp, string name, Model model, Instancing *instancing) {
+    // Append to .c file
+    ofstream outC;
+    outC.open(fp, ios::app);
+    
+    // Prototypes
+    outC << "const int " << name << "Prototypes = " << model.prototypes << ";" << endl;
+    outC << endl;
+    
+    // Prototype ranges per material
+    outC << "const int " << name << "PrototypeFirsts[" << model.prototypes << "][" << model.materials << "] = " << endl;
+    outC << "{" << endl;
+    for (int p = 0; p < model.prototypes; p++) {
+        for (int j = 0; j < model.materials; j++) {
+            outC << instancing->firsts[p*model.materials + j] << ", ";
+        }
+        outC << endl;
+    }
+    outC << "};" << endl;
+    outC << endl;
+    
+    outC << "const int " << name << "PrototypeCounts[" << model.prototypes << "][" << model.materials << "] = " << endl;
+    outC << "{" << endl;
+    for (int p = 0; p < model.prototypes; p++) {
+        for (int j = 0; j < model.materials; j++) {
+            outC << instancing->counts[p*model.materials + j] << ", ";
+        }
+        outC << endl;
+    }
+    outC << "};" << endl;
+    outC << endl;
+    
+    // Instance ranges per prototype
+    outC << "const int " << name << "InstanceFirsts[" << model.prototypes << "] = " << endl;
+    outC << "{" << endl;
+    for (int p = 0; p < model.prototypes; p++) {
+        outC << instancing->instanceFirsts[p] << ", " << endl;
+    }
+    outC << "};" << endl;
+    outC << endl;
+    
+    outC << "const int " << name << "InstanceCounts[" << model.prototypes << "] = " << endl;
+    outC << "{" << endl;
+    for (int p = 0; p < model.prototypes; p++) {
+        outC << instancing->instanceCounts[p] << ", " << endl;
+    }
+    outC << "};" << endl;
+    outC << endl;
+    
+    // Instances, with enough digits to round-trip the transforms
+    outC << "const float " << name << "Instances[" << model.instances << "][12] = " << endl;
+    outC << "{" << endl;
+    outC.precision(9);
+    for (int i = 0; i < model.instances; i++) {
+        for (int k = 0; k < 12; k++) {
+            outC << instancing->transforms[i*12 + k] << ", ";
+        }
+        outC << endl;
+    }
+    outC << "};" << endl;
+    outC << endl;
+    
+    outC.close();
+}
+
+// Print model info
+void printOBJinfo(Model model) {
+    cout << "Model info" << endl;
+    cout << "Positions: " << model.positions << endl;
+    cout << "Texels: " << model.texels << endl;
+    cout << "Normals: " << model.normals << endl;
+    cout << "Faces: " << model.faces << endl;
+    cout << "Vertices: " << model.vertices << endl;
+    cout << "Materials: " << model.materials << endl;
+}
+
+int main(int argc, const char * argv[])
+{
+    // Arguments
+    cout << argc << endl;
+    cout << argv[0] << endl;
+    cout << argv[1] << endl;
+    
+    // Options
+    bool pipelined = false;
+    bool analyze = false;
+    int cacheSize = 32;
+    bool cacheLRU = false;
+    bool cull = false;
+    int cullViews = 64;
+    int cullResolution = 512;
+    bool ao = false;
+    int aoRays = 16;
+    float aoRadius = 0; // Model units, 0 for relative to the model size
+    bool instance = false;
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+        
+        if (option.compare("--pipeline") == 0) {
+            pipelined = true;
+        } else if (option.compare("--analyze") == 0) {
+            analyze = true;
+        } else if (option.compare("--cull") == 0) {
+            cull = true;
+        } else if (option.compare("--cull-views") == 0 && i + 1 < argc) {
+            cullViews = atoi(argv[++i]);
+        } else if (option.compare("--cull-resolution") == 0 && i + 1 < argc) {
+            cullResolution = atoi(argv[++i]);
+        } else if (option.compare("--ao") == 0) {
+            ao = true;
+        } else if (option.compare("--ao-rays") == 0 && i + 1 < argc) {
+            aoRays = atoi(argv[++i]);
+        } else if (option.compare("--ao-radius") == 0 && i + 1 < argc) {
+            aoRadius = atof(argv[++i]);
+        } else if (option.compare("--instance") == 0) {
+            instance = true;
+        } else if (option.compare("--cache-size") == 0 && i + 1 < argc) {
+            cacheSize = atoi(argv[++i]);
+        } else if (option.compare("--cache-policy") == 0 && i + 1 < argc) {
+            string policy = argv[++i];
+            cacheLRU = policy.compare("lru") == 0;
+            
+            if (!cacheLRU && policy.compare("fifo") != 0) {
+                cout << "UNKNOWN CACHE POLICY: " << policy << endl;
+                exit(1);
+            }
+        } else {
+            cout << "UNKNOWN OPTION: " << option << endl;
+            exit(1);
+        }
+    }
+    
+    if (cacheSize < 1) {
+        cout << "INVALID CACHE SIZE: " << cacheSize << endl;
+        exit(1);
+    }
+    
+    if (cullViews < 1) {
+        cout << "INVALID CULL VIEWS: " << cullViews << endl;
+        exit(1);
+    }
+    
+    if (cullResolution < 1) {
+        cout << "INVALID CULL RESOLUTION: " << cullResolution << endl;
+        exit(1);
+    }
+    
+    if (aoRays < 1) {
+        cout << "INVALID AO RAYS: " << aoRays << endl;
+        exit(1);
+    }
+    
+    if (aoRadius < 0) {
+        cout << "INVALID AO RADIUS: " << aoRadius << endl;
+        exit(1);
+    }
+    
+    // The analysis, culling, occlusion and instancing need every face, which the pipelined mode never holds
+    if (pipelined && analyze) {
+        cout << "--analyze CANNOT BE COMBINED WITH --pipeline" << endl;
+        exit(1);
+    }
+    
+    if (pipelined && cull) {
+        cout << "--cull CANNOT BE COMBINED WITH --pipeline" << endl;
+        exit(1);
+    }
+    
+    if (pipelined && ao) {
+        cout << "--ao CANNOT BE COMBINED WITH --pipeline" << endl;
+        exit(1);
+    }
+    
+    if (pipelined && instance) {
+        cout << "--instance CANNOT BE COMBINED WITH --pipeline" << endl;
+        exit(1);
+    }
+    
+    // Filepaths to grab and generate
+    string nameOBJ = argv[1];
+    string filepathOBJ = "source/" + nameOBJ + ".obj";
+    string filepathMTL = "source/" + nameOBJ + ".mtl";
+    string filepathH = "product/" + nameOBJ + ".h";
+    string filepathC = "product/" + nameOBJ + ".c";
+    string filepathJSON = "product/" + nameOBJ + ".json";
+    
+    // Model info, the pipelined mode counts while parsing
+    Model model = {0};
+    if (!pipelined) {
+        model = getOBJinfo(filepathOBJ);
+    }
+    model.materials = getMTLinfo(filepathMTL);
+    if (!pipelined) {
+        printOBJinfo(model);
+    }
+    
+    // Material data
+    string *materials = new string[model.materials];
+    string *map_Kd = new string[model.materials];
+    float kd[model.materials][3];
+    float ks[model.materials][3];
+    float ka[model.materials][3];
+    float ns[model.materials];
+    float ni[model.materials];
+    float d[model.materials];
+    int illum[model.materials];
+    
+    extractMTLdata(filepathMTL, materials, map_Kd, kd, ks, ka, ns, ni, d, illum);
+    cout << "Name1: " << materials[0] << endl;
+    cout << "Kd1: " << kd[0][0] << "r " << kd[0][1] << "g " << kd[0][2] << "b " << endl;
+    cout << "Ks1: " << ks[0][0] << "r " << ks[0][1] << "g " << ks[0][2] << "b " << endl;
+    cout << "Ka1: " << ka[0][0] << "r " << ka[0][1] << "g " << ka[0][2] << "b " << endl;
+    cout << "Ns1: " << ns[0] << endl;
+    cout << "Ni1: " << ni[0] << endl;
+    cout << "d1: " << d[0] << endl;
+    cout << "illum1: " << illum[0] << endl;
+    cout << "map_Kd1: " << map_Kd[0] << endl;
+    
+    // Materials matching to vertices and faces
+    int firsts[model.materials];
+    int counts[model.materials];
+    
+    // Rendering efficiency
+    Analysis analysis = {0};
+    
+    if (pipelined) {
+        // Write .h file and vertex data of .c file
+        convertOBJpipelined(filepathOBJ, filepathH, filepathC, nameOBJ, &model, materials, counts);
+        printOBJinfo(model);
+    } else {
+        // Model data, on the heap since large models overflow the stack
+        float (*positions)[3] = new float[model.positions][3]; // XYZ
+        float (*texels)[2] = new float[model.texels][2]; // UV
+        float (*normals)[3] = new float[model.normals][3]; // XYZ
+        int (*faces)[10] = new int[model.faces][10]; // PTN PTN PTN M
+        
+        extractOBJdata(filepathOBJ, positions, texels, normals, faces, materials, model.materials);
+        cout << "Model data" << endl;
+        cout << "P1: " << positions[0][0] << "x " << positions[0][1] << "y " << positions[0][2] << "z" << endl;
+        cout << "T1: " << texels[0][0] << "U " << texels[0][1] << "V " << endl;
+        cout << "N1: " << normals[0][0] << "x " << normals[0][1] << "y " << normals[0][2] << "z" << endl;
+        cout << "F1v1: " << faces[0][0] << "p " << faces[0][1] << "t " << faces[0][2] << "n" << endl;
+        
+//        cout << "Material references" << endl;
+//        for (int i = 0; i < model.faces; i++) {
+//            int m = faces[i][9];
+//            cout << "F" << i << "m: " << materials[m] << endl;
+//        }
+        
+        // Strip never visible faces
+        if (cull) {
+            int removed = cullOBJfaces(&model, faces, positions, cullViews, cullResolution);
+            cout << "Culled faces: " << removed << endl;
+        }
+        
+        // Ambient occlusion of the remaining faces
+        float (*aos)[3] = NULL;
+        if (ao) {
+            aos = new float[model.faces][3];
+            bakeOBJocclusion(model, faces, positions, normals, aos, aoRays, aoRadius);
+        }
+        
+        // Replace repeated components by instances, after occlusion so copies still occlude
+        Instancing instancing;
+        if (instance) {
+            int removed = detectOBJinstances(&model, faces, positions, texels, normals, aos, &instancing);
+            cout << "Instanced faces: " << removed << endl;
+            cout << "Prototypes: " << model.prototypes << endl;
+            cout << "Instances: " << model.instances << endl;
+        }
+        
+        // Write .h file
+        writeH(filepathH, nameOBJ, model, ao);
+        
+        // Write .c file
+        writeCvertices(filepathC, nameOBJ, model);
+        writeCpositions(filepathC, nameOBJ, model, faces, positions, counts);
+        writeCtexels(filepathC, nameOBJ, model, faces, texels);
+        writeCnormals(filepathC, nameOBJ, model, faces, normals);
+        if (ao) {
+            writeCaos(filepathC, nameOBJ, model, faces, aos);
+        }
+        if (model.prototypes > 0) {
+            writeCinstances(filepathC, nameOBJ, model, &instancing);
+        }
+        
+        if (analyze) {
+            analysis = analyzeOBJdata(model, faces, ao, cacheSize, cacheLRU);
+        }
+        
+        delete [] positions;
+        delete [] texels;
+        delete [] normals;
+        delete [] faces;
+        delete [] aos;
+    }
+    
+    writeCmaterials(filepathC, nameOBJ, model, firsts, counts);
+    writeCkds(filepathC, nameOBJ, model, kd);
+    writeCkas(filepathC, nameOBJ, model, ka);
+    writeCkss(filepathC, nameOBJ, model, ks);
+    writeCnss(filepathC, nameOBJ, model, ns);
+    writeCnis(filepathC, nameOBJ, model, ni);
+    writeCds(filepathC, nameOBJ, model, d);
+    writeCillums(filepathC, nameOBJ, model, illum);
+    writeCmapkds(filepathC, nameOBJ, model, map_Kd); // MIGHT NOT WORK.
+    
+    // Write .json file, after writeCmaterials has set the draw ranges
+    if (analyze) {
+        writeJSONanalysis(filepathJSON, nameOBJ, model, analysis, materials, firsts, counts);
+        cout << "Analysis" << endl;
+        cout << "Unique vertices: " << analysis.uniqueVertices << endl;
+        cout << "Indexed misses: " << analysis.cacheMisses << endl;
+    }
+    
+    return 0;
+}